@@ -6,11 +6,21 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #define BASE_ADDR 0x200
 #define FONTSET_SIZE 80
 #define SCREEN_WIDTH 64
 #define SCREEN_HEIGHT 32
+#define FRAME_USEC 16666
+#define OVERLAY_SCALE 2
+#define LOCKSTEP_LANES 32
+// 4 bytes of padding so gathering a word at the last PC stays in bounds
+#define LOCKSTEP_MEMORY (4096 + 4)
+// Scripted runs tick timers at the same rate as turbo mode
+#define LOCKSTEP_FRAME_INSTRS (FRAME_USEC / 100)
 
 struct emu_state {
   uint8_t registers[16];
@@ -24,6 +34,7 @@ struct emu_state {
   uint8_t keypad[16];
   uint32_t screen[SCREEN_WIDTH * SCREEN_HEIGHT];
   uint16_t opcode;
+  uint32_t rng;
 };
 
 struct key_event {
@@ -31,6 +42,40 @@ struct key_event {
     uint8_t down;
 };
 
+// Raw counters bumped by the main loop. They are only turned into
+// rates once per second (see update_metrics) so they can stay on.
+// Everything is reset at the start of each one second window
+struct emu_stats {
+  uint64_t instructions;
+  uint64_t timer_drift_usec;
+  uint64_t presents;
+  uint64_t emulate_ticks;
+  uint64_t render_ticks;
+  uint64_t input_ticks;
+  uint64_t wait_key_ticks;
+  uint64_t run_ahead_ticks;
+  uint64_t run_ahead_frames;
+};
+
+// What gets published to the stats file and the overlay
+struct emu_metrics {
+  double instructions_per_sec;
+  double emulated_fps;
+  double real_fps;
+  double timer_drift_ms;
+  double emulate_pct;
+  double render_pct;
+  double input_pct;
+  double wait_key_ms;
+  double run_ahead_ms;
+  // Instructions actually run per 60Hz frame, used by run-ahead
+  double instrs_per_frame;
+  // Lets a monitor tell a stale file from a stalled emulator
+  uint64_t sequence;
+  int paused;
+  int waiting_key;
+};
+
 uint8_t fontset[FONTSET_SIZE] = {
     0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
     0x20, 0x60, 0x20, 0x20, 0x70, // 1
@@ -128,14 +173,23 @@ uint16_t load_rom(char *file_name, struct emu_state *emulator_state) {
   FILE *file = fopen(file_name, "r");
 
   if (file == NULL) {
-    printf("Error reading ROM file.");
+    printf("Error reading ROM file.\n");
     return -1;
   }
 
   fseek(file, 0L, SEEK_END);
-  uint16_t rom_size = ftell(file);
+  long file_size = ftell(file);
   fseek(file, 0L, SEEK_SET);
 
+  // Anything past the end of memory would overrun the state
+  if (file_size > (long)sizeof(emulator_state->memory) - BASE_ADDR) {
+    printf("ROM file is too large (%ld bytes, at most %d).\n", file_size,
+           (int)sizeof(emulator_state->memory) - BASE_ADDR);
+    fclose(file);
+    return -1;
+  }
+  uint16_t rom_size = file_size;
+
 #ifndef NDEBUG
   printf("ROM size is %d bytes\n", rom_size);
 #endif
@@ -166,7 +220,7 @@ void instr_CLS(struct emu_state *emulator_state) {
 void instr_RET(struct emu_state *emulator_state) {
   emulator_state->stack_pointer--;
   emulator_state->program_counter =
-      emulator_state->stack[emulator_state->stack_pointer];
+      emulator_state->stack[emulator_state->stack_pointer & 0xFU];
   emulator_state->program_counter += 2;
 }
 
@@ -179,7 +233,7 @@ void instr_JP(struct emu_state *emulator_state) {
 // CALL instruction is like JP, but the stack is
 // modified, kind of the reverse of RET
 void instr_CALL(struct emu_state *emulator_state) {
-  emulator_state->stack[emulator_state->stack_pointer] =
+  emulator_state->stack[emulator_state->stack_pointer & 0xFU] =
       emulator_state->program_counter;
   emulator_state->stack_pointer++;
   emulator_state->program_counter = emulator_state->opcode & 0x0FFFu;
@@ -376,7 +430,7 @@ void instr_LD_reg_I(struct emu_state *emulator_state) {
   unsigned int reg = (emulator_state->opcode & 0x0F00U) >> 8;
   for (unsigned int i = 0; i <= reg; i++) {
     emulator_state->registers[i] =
-        emulator_state->memory[emulator_state->index + i];
+        emulator_state->memory[(emulator_state->index + i) & 0x0FFFU];
   }
   emulator_state->index++;
   emulator_state->program_counter += 2;
@@ -385,7 +439,7 @@ void instr_LD_reg_I(struct emu_state *emulator_state) {
 void instr_LD_I_reg(struct emu_state *emulator_state) {
   unsigned int reg = (emulator_state->opcode & 0x0F00U) >> 8;
   for (unsigned int i = 0; i <= reg; i++) {
-    emulator_state->memory[emulator_state->index + i] =
+    emulator_state->memory[(emulator_state->index + i) & 0x0FFFU] =
         emulator_state->registers[i];
   }
   emulator_state->index++;
@@ -395,11 +449,11 @@ void instr_LD_I_reg(struct emu_state *emulator_state) {
 void instr_LD_B_reg(struct emu_state *emulator_state) {
   unsigned int val =
       emulator_state->registers[(emulator_state->opcode & 0x0F00U) >> 8];
-  emulator_state->memory[emulator_state->index + 2] = val % 10;
+  emulator_state->memory[(emulator_state->index + 2) & 0x0FFFU] = val % 10;
   val /= 10;
-  emulator_state->memory[emulator_state->index + 1] = val % 10;
+  emulator_state->memory[(emulator_state->index + 1) & 0x0FFFU] = val % 10;
   val /= 10;
-  emulator_state->memory[emulator_state->index + 0] = val % 10;
+  emulator_state->memory[(emulator_state->index + 0) & 0x0FFFU] = val % 10;
   emulator_state->program_counter += 2;
 }
 
@@ -428,11 +482,12 @@ void instr_DRW(struct emu_state *emulator_state) {
   emulator_state->registers[0xF] = 0;
   for (unsigned int r = 0; r < size; r++) {
     for (unsigned int c = 0; c < 8; c++) {
+      if(r+y_cord >= SCREEN_HEIGHT || x_cord + c >= SCREEN_WIDTH) continue;
       uint32_t *screen_pixel =
           &emulator_state->screen[(r + y_cord) * SCREEN_WIDTH + (x_cord + c)];
-      if(r+y_cord >= SCREEN_HEIGHT || x_cord + c >= SCREEN_WIDTH) continue;
       uint8_t sprite_pixel =
-          emulator_state->memory[emulator_state->index + r] & (0x80U >> c);
+          emulator_state->memory[(emulator_state->index + r) & 0x0FFFU] &
+          (0x80U >> c);
       if (sprite_pixel) {
         if (*screen_pixel == 0xFFFFFFFF) {
           emulator_state->registers[0xF] = 1;
@@ -445,8 +500,13 @@ void instr_DRW(struct emu_state *emulator_state) {
   emulator_state->program_counter += 2;
 }
 
+// RND uses an xorshift kept in the state instead of rand() so a copy
+// of the state (see run_ahead) replays the same numbers
 void instr_RND_reg(struct emu_state *emulator_state) {
-  uint8_t rand_num = rand() % 256;
+  emulator_state->rng ^= emulator_state->rng << 13;
+  emulator_state->rng ^= emulator_state->rng >> 17;
+  emulator_state->rng ^= emulator_state->rng << 5;
+  uint8_t rand_num = emulator_state->rng % 256;
   emulator_state->registers[(emulator_state->opcode & 0x0F00U) >> 8] =
       (emulator_state->opcode & 0x00FFU) & rand_num;
   emulator_state->program_counter += 2;
@@ -458,7 +518,7 @@ void instr_NOP(struct emu_state *emulator_state) {
 
 void instr_SKP_reg(struct emu_state *emulator_state) {
   uint8_t wanted_key = emulator_state->registers[(emulator_state->opcode & 0x0F00U) >> 8];
-  if (emulator_state->keypad[wanted_key] == 1) {
+  if (emulator_state->keypad[wanted_key & 0xFU] == 1) {
     emulator_state->program_counter += 2;
   }
   emulator_state->program_counter += 2;
@@ -466,7 +526,7 @@ void instr_SKP_reg(struct emu_state *emulator_state) {
 
 void instr_SKNP_reg(struct emu_state *emulator_state) {
   uint8_t unwanted_key = emulator_state->registers[(emulator_state->opcode & 0x0F00U) >> 8];
-  if (emulator_state->keypad[unwanted_key] == 0) {
+  if (emulator_state->keypad[unwanted_key & 0xFU] == 0) {
     emulator_state->program_counter += 2;
   }
   emulator_state->program_counter += 2;
@@ -488,7 +548,8 @@ void instr_LD_reg_DT(struct emu_state *emulator_state) {
 }
 
 void instr_LD_F_reg(struct emu_state *emulator_state) {
-  emulator_state->index = fontset[emulator_state->registers[(emulator_state->opcode & 0x0F00U) >> 8] = emulator_state->delay_timer];
+  uint8_t digit = emulator_state->registers[(emulator_state->opcode & 0x0F00U) >> 8] = emulator_state->delay_timer;
+  emulator_state->index = digit < FONTSET_SIZE ? fontset[digit] : 0;
   emulator_state->program_counter += 2;
 }
 
@@ -589,13 +650,1220 @@ void *get_op_func(uint16_t opcode) {
   return NULL;
 }
 
+// Loads the instruction at program_counter into opcode and returns
+// the function that executes it (NULL if it's illegal). Addresses
+// wrap at 4K here and in the instructions, same as in lockstep
+void *fetch_op(struct emu_state *emulator_state) {
+  uint16_t pc = emulator_state->program_counter;
+  emulator_state->opcode =
+      (((uint16_t)emulator_state->memory[pc & 0x0FFFU]) << 8) |
+      (uint16_t)emulator_state->memory[(pc + 1) & 0x0FFFU];
+  return get_op_func(emulator_state->opcode);
+}
+
+// Run-ahead: copies the machine into ahead and runs the copy frames
+// frames into the future with the keypad as it is now. The real
+// state is never touched, so the copy is the whole save/restore.
+// Stops early on Fx0A since that would block on real input
+void run_ahead(struct emu_state *ahead, struct emu_state *emulator_state,
+               int frames, int instrs_per_frame) {
+  *ahead = *emulator_state;
+
+  for (int f = 0; f < frames; f++) {
+    for (int n = 0; n < instrs_per_frame; n++) {
+      void (*op_func)(struct emu_state *) = fetch_op(ahead);
+      if (op_func == NULL || op_func == &instr_LD_reg_K) {
+        return;
+      }
+      op_func(ahead);
+    }
+    if (ahead->sound_timer > 0) {
+      ahead->sound_timer--;
+    }
+    if (ahead->delay_timer > 0) {
+      ahead->delay_timer--;
+    }
+  }
+}
+
+// Turns one window worth of counters into rates. elapsed is in
+// SDL performance counter ticks. The emulated frame rate comes from the
+// work done (instructions over the instructions a frame should take),
+// so it drops when the interpreter falls behind even though the
+// wall clock timers keep ticking at 60Hz
+void update_metrics(struct emu_metrics *metrics, struct emu_stats *stats,
+                    uint64_t elapsed, int instrs_per_frame) {
+  double freq = (double)SDL_GetPerformanceFrequency();
+  double secs = elapsed / freq;
+
+  metrics->instructions_per_sec = stats->instructions / secs;
+  metrics->emulated_fps = stats->instructions / secs / instrs_per_frame;
+  metrics->instrs_per_frame = stats->instructions / secs * FRAME_USEC / 1000000;
+  metrics->real_fps = stats->presents / secs;
+  metrics->timer_drift_ms = stats->timer_drift_usec / 1000.0;
+  metrics->emulate_pct = 100.0 * stats->emulate_ticks / elapsed;
+  metrics->render_pct = 100.0 * stats->render_ticks / elapsed;
+  metrics->input_pct = 100.0 * stats->input_ticks / elapsed;
+  metrics->wait_key_ms = 1000.0 * stats->wait_key_ticks / freq;
+  // Cost per real frame, not per emulated frame ahead
+  metrics->run_ahead_ms =
+      stats->run_ahead_frames
+          ? 1000.0 * stats->run_ahead_ticks / freq / stats->run_ahead_frames
+          : 0;
+}
+
+// Writes the metrics to a temp file and renames it over the real one
+// so a monitor never sees a half written file. Pointing this at
+// /dev/shm keeps it in memory
+void write_stats_file(char *file_name, struct emu_metrics *metrics) {
+  char tmp_name[4096];
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  metrics->sequence++;
+  snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", file_name);
+
+  FILE *file = fopen(tmp_name, "w");
+
+  if (file == NULL) {
+    printf("Error writing stats file.\n");
+    return;
+  }
+
+  fprintf(file, "sequence %lu\n", (unsigned long)metrics->sequence);
+  fprintf(file, "timestamp_ms %lld\n",
+          (long long)now.tv_sec * 1000 + now.tv_usec / 1000);
+  fprintf(file, "paused %d\n", metrics->paused);
+  fprintf(file, "waiting_key %d\n", metrics->waiting_key);
+  fprintf(file, "instructions_per_sec %.0f\n", metrics->instructions_per_sec);
+  fprintf(file, "emulated_fps %.2f\n", metrics->emulated_fps);
+  fprintf(file, "real_fps %.2f\n", metrics->real_fps);
+  fprintf(file, "timer_drift_ms %.3f\n", metrics->timer_drift_ms);
+  fprintf(file, "emulate_pct %.2f\n", metrics->emulate_pct);
+  fprintf(file, "render_pct %.2f\n", metrics->render_pct);
+  fprintf(file, "input_pct %.2f\n", metrics->input_pct);
+  fprintf(file, "wait_key_ms %.3f\n", metrics->wait_key_ms);
+  fprintf(file, "run_ahead_ms %.3f\n", metrics->run_ahead_ms);
+
+  fclose(file);
+  rename(tmp_name, file_name);
+}
+
+// Draws a decimal number with the Chip-8 font so the overlay
+// doesn't need SDL_ttf
+void draw_number(SDL_Renderer *renderer, int x, int y, unsigned long value) {
+  char digits[21];
+  int len = snprintf(digits, sizeof(digits), "%lu", value);
+
+  for (int d = 0; d < len; d++) {
+    uint8_t *glyph = &fontset[(digits[d] - '0') * 5];
+    for (int r = 0; r < 5; r++) {
+      for (int c = 0; c < 4; c++) {
+        if (glyph[r] & (0x80U >> c)) {
+          SDL_Rect pixel = {x + (d * 5 + c) * OVERLAY_SCALE,
+                            y + r * OVERLAY_SCALE, OVERLAY_SCALE,
+                            OVERLAY_SCALE};
+          SDL_RenderFillRect(renderer, &pixel);
+        }
+      }
+    }
+  }
+}
 
+// One number per line: instructions/sec, real fps, emulated fps,
+// timer drift (ms), Fx0A wait (ms), run-ahead cost (us per frame)
+void draw_overlay(SDL_Renderer *renderer, struct emu_metrics *metrics) {
+  unsigned long lines[] = {
+      metrics->instructions_per_sec, metrics->real_fps, metrics->emulated_fps,
+      metrics->timer_drift_ms, metrics->wait_key_ms,
+      metrics->run_ahead_ms * 1000};
+
+  SDL_SetRenderDrawColor(renderer, 0, 255, 0, 255);
+  for (unsigned int i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+    draw_number(renderer, OVERLAY_SCALE, OVERLAY_SCALE + i * 6 * OVERLAY_SCALE,
+                lines[i]);
+  }
+  SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+}
+
+// Lockstep mode runs one ROM on many machines at once, each with its
+// own RNG seed and input script. Registers, I, PC and timers are kept
+// in struct-of-arrays form with one element per lane, so the
+// instruction all lanes agree on runs as a handful of vector ops
+// (the V registers are one AVX2 register each when built with
+// -mavx2). Everything addressed per lane (stack, keypad, memory,
+// screen) stays per lane and is handled with a loop over the lanes
+// in the mask
+typedef uint8_t lane_u8 __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef uint16_t part_u16 __attribute__((vector_size(32)));
+typedef uint32_t part_u32 __attribute__((vector_size(32)));
+
+// 16 and 32 bit lanes don't fit in one AVX2 register, so they are
+// split into register sized parts. GCC handles wider vectors by
+// bouncing them through the stack, which costs more than the work
+union lane_u16 {
+  uint16_t lane[LOCKSTEP_LANES];
+  part_u16 part[LOCKSTEP_LANES / 16];
+};
+
+union lane_u32 {
+  uint32_t lane[LOCKSTEP_LANES];
+  part_u32 part[LOCKSTEP_LANES / 8];
+};
+
+// Picks a where mask is set, b where it isn't
+#define LANE_BLEND(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+// Loops l over the lanes whose bit is set in mask
+#define FOR_EACH_LANE(l, mask)                                                 \
+  for (uint32_t l##_left = (mask), l = 0;                                      \
+       l##_left && ((l = __builtin_ctz(l##_left)), 1);                         \
+       l##_left &= l##_left - 1)
+
+// A lane's RNG seed and input script. keys holds the keypad for each
+// frame as a bitmask (bit k is key k), no key is held past the end.
+// Without keys a script is made up from the seed
+struct lane_script {
+  uint32_t seed;
+  uint16_t *keys;
+  long frames;
+};
+
+struct lockstep_state {
+  lane_u8 registers[16];
+  union lane_u16 index;
+  union lane_u16 program_counter;
+  lane_u8 sound_timer;
+  lane_u8 delay_timer;
+  union lane_u32 rng;
+  // Lanes run in chunks that end at their next frame boundary (or
+  // at max_steps), so the per instruction bookkeeping is one byte
+  // per lane. steps counts the instructions before the chunk
+  lane_u8 chunk_left;
+  uint8_t chunk[LOCKSTEP_LANES];
+  uint32_t steps[LOCKSTEP_LANES];
+  // Bit l is set while lane l is running / if it hit an illegal
+  // instruction. dead is 0xFFFF for lanes that aren't running
+  uint32_t live;
+  uint32_t illegal;
+  union lane_u16 dead;
+  // Offset of each lane's memory, for the gather in lockstep_fetch
+  union lane_u32 memory_base;
+  uint16_t stack[LOCKSTEP_LANES][16];
+  uint8_t stack_pointer[LOCKSTEP_LANES];
+  uint8_t keypad[LOCKSTEP_LANES][16];
+  struct lane_script script[LOCKSTEP_LANES];
+  // One bit per pixel, bit c of row r is pixel (c, r)
+  uint64_t screen[LOCKSTEP_LANES][SCREEN_HEIGHT];
+  uint8_t memory[LOCKSTEP_LANES][LOCKSTEP_MEMORY];
+  // Set for addresses any lane has stored to. Until then every lane
+  // has the ROM's opcode there and fetching per lane can be skipped
+  uint8_t written[LOCKSTEP_MEMORY];
+};
+
+// Lockstep decodes through a table filled from get_op_func, so it
+// shares the scalar decoder but dispatches with a switch
+enum lockstep_op {
+  LS_ILLEGAL,
+  LS_CLS,
+  LS_RET,
+  LS_JP,
+  LS_CALL,
+  LS_SE,
+  LS_SNE,
+  LS_SE_REG,
+  LS_SNE_REG,
+  LS_LD,
+  LS_ADD,
+  LS_LD_REG,
+  LS_OR_REG,
+  LS_AND_REG,
+  LS_XOR_REG,
+  LS_ADD_REG,
+  LS_SUB_REG,
+  LS_SHR_REG,
+  LS_SHL_REG,
+  LS_SUBN_REG,
+  LS_LD_I,
+  LS_ADD_I_REG,
+  LS_LD_REG_I,
+  LS_LD_I_REG,
+  LS_LD_B_REG,
+  LS_DRW,
+  LS_RND_REG,
+  LS_NOP,
+  LS_SKP_REG,
+  LS_SKNP_REG,
+  LS_LD_DT_REG,
+  LS_LD_ST_REG,
+  LS_LD_REG_DT,
+  LS_LD_F_REG,
+  LS_LD_REG_K
+};
+
+uint8_t lockstep_decode[0x10000];
+
+// Sets the keypad for a frame of a lane's input script. Made up
+// scripts hold either nothing or one key (picked from the seed and
+// frame number) every frame
+void script_keypad(uint8_t *keypad, struct lane_script *script, long frame) {
+  memset(keypad, 0, 16);
+
+  if (script->keys != NULL) {
+    uint16_t keys = frame < script->frames ? script->keys[frame] : 0;
+    for (int k = 0; k < 16; k++) {
+      keypad[k] = (keys >> k) & 1;
+    }
+    return;
+  }
+
+  uint32_t h = script->seed ^ ((uint32_t)frame * 0x9E3779B9U);
+  h ^= h >> 16;
+  h *= 0x85EBCA6BU;
+  h ^= h >> 13;
+
+  if (h & 0x100U) {
+    keypad[h & 0xFU] = 1;
+  }
+}
+
+// Fx0A for scripted runs: instead of blocking on SDL it takes the
+// lowest held key, or stays on this instruction if none is held
+void instr_LD_reg_K_scripted(struct emu_state *emulator_state) {
+  for (uint8_t k = 0; k < 16; k++) {
+    if (emulator_state->keypad[k]) {
+      emulator_state->delay_timer = 0;
+      emulator_state->registers[(emulator_state->opcode & 0x0F00U) >> 8] = k;
+      emulator_state->program_counter += 2;
+      return;
+    }
+  }
+}
+
+// Runs one instruction of a scripted lane on the normal interpreter.
+// Timers tick and the script advances every LOCKSTEP_FRAME_INSTRS
+// instructions so the result only depends on the step count.
+// Returns 0 on an illegal instruction
+int scripted_step(struct emu_state *emulator_state, struct lane_script *script,
+                  long step) {
+  if (step % LOCKSTEP_FRAME_INSTRS == 0) {
+    if (step > 0 && emulator_state->sound_timer > 0) {
+      emulator_state->sound_timer--;
+    }
+    if (step > 0 && emulator_state->delay_timer > 0) {
+      emulator_state->delay_timer--;
+    }
+    script_keypad(emulator_state->keypad, script, step / LOCKSTEP_FRAME_INSTRS);
+  }
+
+  void (*op_func)(struct emu_state *) = fetch_op(emulator_state);
+  if (op_func == NULL) {
+    return 0;
+  }
+  if (op_func == &instr_LD_reg_K) {
+    op_func = &instr_LD_reg_K_scripted;
+  }
+  op_func(emulator_state);
+  return 1;
+}
+
+uint32_t lane_seed(uint32_t base_seed, int lane) {
+  return ((base_seed + lane) * 0x9E3779B9U) | 1;
+}
+
+// Reads one script per line, a seed followed by the held keys of each
+// frame as hex bitmasks, e.g. "0x1234 0 0 10 10 0". Blank lines and
+// lines starting with # are skipped. Returns 0 on error
+int load_lane_scripts(char *file_name, struct lane_script *scripts,
+                      int lanes) {
+  FILE *file = fopen(file_name, "r");
+
+  if (file == NULL) {
+    printf("Error reading script file.\n");
+    return 0;
+  }
+
+  char *line = NULL;
+  size_t line_size = 0;
+  int loaded = 0;
+  int line_number = 0;
+  while (loaded < lanes && getline(&line, &line_size, file) != -1) {
+    char *pos = line;
+    char *end;
+    line_number++;
+    uint32_t seed = strtoul(pos, &end, 0);
+    if (end == pos) {
+      continue;
+    }
+    // xorshift never leaves 0, so RND would always return 0
+    if (seed == 0) {
+      printf("Script file line %d: seed must be nonzero.\n", line_number);
+      free(line);
+      fclose(file);
+      return 0;
+    }
+
+    struct lane_script *script = &scripts[loaded++];
+    script->seed = seed;
+    script->frames = 0;
+    long capacity = 0;
+    for (pos = end;; pos = end) {
+      unsigned long keys = strtoul(pos, &end, 16);
+      if (end == pos) {
+        break;
+      }
+      if (script->frames == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        script->keys = realloc(script->keys, capacity * sizeof(uint16_t));
+      }
+      script->keys[script->frames++] = keys;
+    }
+  }
+
+  free(line);
+  fclose(file);
+
+  if (loaded < lanes) {
+    printf("Script file has %d lanes, %d needed.\n", loaded, lanes);
+    return 0;
+  }
+  return 1;
+}
+
+void lockstep_build_decode(void) {
+  struct {
+    void (*func)(struct emu_state *);
+    enum lockstep_op op;
+  } ops[] = {
+      {&instr_CLS, LS_CLS},           {&instr_RET, LS_RET},
+      {&instr_JP, LS_JP},             {&instr_JP_reg0, LS_JP},
+      {&instr_CALL, LS_CALL},         {&instr_SE, LS_SE},
+      {&instr_SNE, LS_SNE},           {&instr_SE_reg, LS_SE_REG},
+      {&instr_SNE_reg, LS_SNE_REG},   {&instr_LD, LS_LD},
+      {&instr_ADD, LS_ADD},           {&instr_LD_reg, LS_LD_REG},
+      {&instr_OR_reg, LS_OR_REG},     {&instr_AND_reg, LS_AND_REG},
+      {&instr_XOR_reg, LS_XOR_REG},   {&instr_ADD_reg, LS_ADD_REG},
+      {&instr_SUB_reg, LS_SUB_REG},   {&instr_SHR_reg, LS_SHR_REG},
+      {&instr_SHL_reg, LS_SHL_REG},   {&instr_SUBN_reg, LS_SUBN_REG},
+      {&instr_LD_I, LS_LD_I},         {&instr_ADD_I_reg, LS_ADD_I_REG},
+      {&instr_LD_reg_I, LS_LD_REG_I}, {&instr_LD_I_reg, LS_LD_I_REG},
+      {&instr_LD_B_reg, LS_LD_B_REG}, {&instr_DRW, LS_DRW},
+      {&instr_RND_reg, LS_RND_REG},   {&instr_NOP, LS_NOP},
+      {&instr_SYS, LS_NOP},           {&instr_SKP_reg, LS_SKP_REG},
+      {&instr_SKNP_reg, LS_SKNP_REG}, {&instr_LD_DT_reg, LS_LD_DT_REG},
+      {&instr_LD_ST_reg, LS_LD_ST_REG}, {&instr_LD_reg_DT, LS_LD_REG_DT},
+      {&instr_LD_F_reg, LS_LD_F_REG}, {&instr_LD_reg_K, LS_LD_REG_K}};
+
+  for (uint32_t opcode = 0; opcode < 0x10000; opcode++) {
+    void (*op_func)(struct emu_state *) = get_op_func(opcode);
+    lockstep_decode[opcode] = LS_ILLEGAL;
+    for (unsigned int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+      if (ops[i].func == op_func) {
+        lockstep_decode[opcode] = ops[i].op;
+        break;
+      }
+    }
+  }
+}
+
+// Starts the lane's next chunk: up to its next frame boundary or
+// max_steps, whichever comes first
+void lockstep_start_chunk(struct lockstep_state *ls, int l,
+                          uint32_t max_steps) {
+  uint32_t left = max_steps - ls->steps[l];
+  uint32_t to_frame =
+      LOCKSTEP_FRAME_INSTRS - ls->steps[l] % LOCKSTEP_FRAME_INSTRS;
+  ls->chunk[l] = left < to_frame ? left : to_frame;
+  ls->chunk_left[l] = ls->chunk[l];
+}
+
+void lockstep_stop(struct lockstep_state *ls, uint32_t lanes) {
+  ls->live &= ~lanes;
+  FOR_EACH_LANE(l, lanes) {
+    ls->dead.lane[l] = 0xFFFF;
+  }
+}
+
+void lockstep_init(struct lockstep_state *ls, struct emu_state *initial,
+                   int lanes, struct lane_script *scripts,
+                   uint32_t max_steps) {
+  memset(ls, 0, sizeof(*ls));
+  for (int l = 0; l < LOCKSTEP_LANES; l++) {
+    ls->memory_base.lane[l] = l * LOCKSTEP_MEMORY;
+    ls->dead.lane[l] = 0xFFFF;
+  }
+  for (int l = 0; l < lanes; l++) {
+    ls->program_counter.lane[l] = initial->program_counter;
+    ls->script[l] = scripts[l];
+    ls->rng.lane[l] = scripts[l].seed;
+    memcpy(ls->memory[l], initial->memory, sizeof(initial->memory));
+    script_keypad(ls->keypad[l], &ls->script[l], 0);
+    lockstep_start_chunk(ls, l, max_steps);
+    if (ls->chunk[l] > 0) {
+      ls->live |= 1U << l;
+      ls->dead.lane[l] = 0;
+    }
+  }
+}
+
+// Instructions lane l has run so far
+uint32_t lockstep_lane_steps(struct lockstep_state *ls, int l) {
+  return ls->steps[l] + ls->chunk[l] - ls->chunk_left[l];
+}
+
+// Bit l of the result is set if element l of mask is
+uint32_t lane_bits(lane_u8 *mask) {
+#ifdef __AVX2__
+  return _mm256_movemask_epi8((__m256i)*mask);
+#else
+  uint32_t bits = 0;
+  for (int l = 0; l < LOCKSTEP_LANES; l++) {
+    if ((*mask)[l]) {
+      bits |= 1U << l;
+    }
+  }
+  return bits;
+#endif
+}
+
+uint32_t lane_bits16(union lane_u16 *mask) {
+#ifdef __AVX2__
+  // packs works within 128 bit halves, the permute puts lanes back
+  // in order
+  __m256i packed =
+      _mm256_packs_epi16((__m256i)mask->part[0], (__m256i)mask->part[1]);
+  return _mm256_movemask_epi8(_mm256_permute4x64_epi64(packed, 0xD8));
+#else
+  uint32_t bits = 0;
+  for (int l = 0; l < LOCKSTEP_LANES; l++) {
+    if (mask->lane[l]) {
+      bits |= 1U << l;
+    }
+  }
+  return bits;
+#endif
+}
+
+// The reverse of lane_bits: element l is all ones if bit l is set
+void lane_mask8(lane_u8 *mask, uint32_t bits) {
+  lane_u8 lane_bit = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4,
+                      8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32,
+                      64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+  lane_u8 bytes;
+  for (int l = 0; l < LOCKSTEP_LANES; l++) {
+    bytes[l] = bits >> (l & ~7);
+  }
+  *mask = (lane_u8)((bytes & lane_bit) != 0);
+}
+
+void lane_mask16(union lane_u16 *mask, uint32_t bits) {
+  part_u16 lane_bit = {1,     2,     4,     8,      16,     32,
+                       64,    128,   256,   512,    1024,   2048,
+                       4096,  8192,  16384, 32768};
+  for (int p = 0; p < LOCKSTEP_LANES / 16; p++) {
+    part_u16 part_bits = (part_u16){0} + (uint16_t)(bits >> (16 * p));
+    mask->part[p] = (part_u16)((part_bits & lane_bit) != 0);
+  }
+}
+
+void lane_mask32(union lane_u32 *mask, uint32_t bits) {
+  part_u32 lane_bit = {1, 2, 4, 8, 16, 32, 64, 128};
+  for (int p = 0; p < LOCKSTEP_LANES / 8; p++) {
+    part_u32 part_bits = (part_u32){0} + ((bits >> (8 * p)) & 0xFFU);
+    mask->part[p] = (part_u32)((part_bits & lane_bit) != 0);
+  }
+}
+
+uint16_t lane_min(union lane_u16 *values) {
+#ifdef __AVX2__
+  __m256i halves =
+      _mm256_min_epu16((__m256i)values->part[0], (__m256i)values->part[1]);
+  __m128i quarter = _mm_min_epu16(_mm256_castsi256_si128(halves),
+                                  _mm256_extracti128_si256(halves, 1));
+  return _mm_cvtsi128_si32(_mm_minpos_epu16(quarter)) & 0xFFFF;
+#else
+  uint16_t min = 0xFFFF;
+  for (int l = 0; l < LOCKSTEP_LANES; l++) {
+    min = values->lane[l] < min ? values->lane[l] : min;
+  }
+  return min;
+#endif
+}
+
+// Reads the opcode at each lane's PC
+void lockstep_fetch(struct lockstep_state *ls, union lane_u16 *opcodes) {
+#ifdef __AVX2__
+  // Gather 4 bytes at pc for 8 lanes at a time, the first two are
+  // the opcode (memory is padded so this never reads past the end)
+  for (int p = 0; p < LOCKSTEP_LANES / 8; p++) {
+    __m256i pcs = _mm256_cvtepu16_epi32(
+        _mm_loadu_si128((__m128i *)&ls->program_counter.lane[8 * p]));
+    __m256i offsets =
+        _mm256_add_epi32((__m256i)ls->memory_base.part[p],
+                         _mm256_and_si256(pcs, _mm256_set1_epi32(0x0FFF)));
+    __m256i words =
+        _mm256_i32gather_epi32((const int *)ls->memory, offsets, 1);
+    // byte 0 is the high byte of the opcode, byte 1 the low one
+    __m256i ops = _mm256_or_si256(
+        _mm256_slli_epi32(_mm256_and_si256(words, _mm256_set1_epi32(0xFF)), 8),
+        _mm256_and_si256(_mm256_srli_epi32(words, 8), _mm256_set1_epi32(0xFF)));
+    _mm_storeu_si128((__m128i *)&opcodes->lane[8 * p],
+                     _mm_packus_epi32(_mm256_castsi256_si128(ops),
+                                      _mm256_extracti128_si256(ops, 1)));
+    // At 0xFFF the low byte wraps to address 0, not the padding
+    uint32_t wrap = _mm256_movemask_ps((__m256)_mm256_cmpeq_epi32(
+        _mm256_and_si256(pcs, _mm256_set1_epi32(0x0FFF)),
+        _mm256_set1_epi32(0x0FFF)));
+    FOR_EACH_LANE(i, wrap) {
+      int l = 8 * p + i;
+      opcodes->lane[l] = (((uint16_t)ls->memory[l][0x0FFF]) << 8) |
+                         (uint16_t)ls->memory[l][0];
+    }
+  }
+#else
+  for (int l = 0; l < LOCKSTEP_LANES; l++) {
+    uint16_t pc = ls->program_counter.lane[l];
+    opcodes->lane[l] = (((uint16_t)ls->memory[l][pc & 0x0FFFU]) << 8) |
+                       (uint16_t)ls->memory[l][(pc + 1) & 0x0FFFU];
+  }
+#endif
+}
+
+// Reads the byte at (address + offset) & 0xFFF from each lane's
+// memory. Lanes that aren't running read too, the caller masks them
+void lockstep_gather(struct lockstep_state *ls, union lane_u16 *address,
+                     unsigned int offset, lane_u8 *bytes) {
+#ifdef __AVX2__
+  __m256i words[LOCKSTEP_LANES / 8];
+  for (int p = 0; p < LOCKSTEP_LANES / 8; p++) {
+    __m256i addresses = _mm256_cvtepu16_epi32(
+        _mm_loadu_si128((__m128i *)&address->lane[8 * p]));
+    addresses = _mm256_and_si256(
+        _mm256_add_epi32(addresses, _mm256_set1_epi32(offset)),
+        _mm256_set1_epi32(0x0FFF));
+    words[p] = _mm256_and_si256(
+        _mm256_i32gather_epi32(
+            (const int *)ls->memory,
+            _mm256_add_epi32((__m256i)ls->memory_base.part[p], addresses), 1),
+        _mm256_set1_epi32(0xFF));
+  }
+  // packs work within 128 bit halves, the permute puts lanes back
+  // in order
+  __m256i packed =
+      _mm256_packus_epi16(_mm256_packus_epi32(words[0], words[1]),
+                          _mm256_packus_epi32(words[2], words[3]));
+  *bytes = (lane_u8)_mm256_permutevar8x32_epi32(
+      packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+#else
+  for (int l = 0; l < LOCKSTEP_LANES; l++) {
+    (*bytes)[l] = ls->memory[l][(address->lane[l] + offset) & 0x0FFFU];
+  }
+#endif
+}
+
+// XORs one sprite row into screen row rows[l] at x_cords[l] for the
+// lanes in on. sprite has pixel c in bit c (already reversed).
+// Returns the lanes where a lit pixel was turned off
+uint32_t lockstep_draw_row(struct lockstep_state *ls, lane_u8 *rows,
+                           lane_u8 *sprite, lane_u8 *x_cords, uint32_t on) {
+  uint32_t hit = 0;
+#ifdef __AVX2__
+  // Rows are read with a gather 4 lanes at a time, AVX2 has no
+  // scatter so they're written back one by one
+  for (int q = 0; q < LOCKSTEP_LANES / 4; q++) {
+    uint32_t on_q = (on >> (4 * q)) & 0xFU;
+    if (on_q == 0) {
+      continue;
+    }
+    int32_t rows4, sprite4, x4;
+    memcpy(&rows4, (uint8_t *)rows + 4 * q, 4);
+    memcpy(&sprite4, (uint8_t *)sprite + 4 * q, 4);
+    memcpy(&x4, (uint8_t *)x_cords + 4 * q, 4);
+
+    __m128i offsets = _mm_add_epi32(
+        _mm_cvtepu8_epi32(_mm_cvtsi32_si128(rows4)),
+        _mm_setr_epi32(4 * q * SCREEN_HEIGHT, (4 * q + 1) * SCREEN_HEIGHT,
+                       (4 * q + 2) * SCREEN_HEIGHT,
+                       (4 * q + 3) * SCREEN_HEIGHT));
+    __m256i pixels =
+        _mm256_i32gather_epi64((const long long *)ls->screen, offsets, 8);
+    __m256i bits =
+        _mm256_sllv_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(sprite4)),
+                          _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(x4)));
+    uint32_t lit = ~_mm256_movemask_pd((__m256d)_mm256_cmpeq_epi64(
+                       _mm256_and_si256(pixels, bits),
+                       _mm256_setzero_si256())) &
+                   on_q;
+    hit |= lit << (4 * q);
+
+    uint64_t drawn[4];
+    _mm256_storeu_si256((__m256i *)drawn, _mm256_xor_si256(pixels, bits));
+    FOR_EACH_LANE(i, on_q) {
+      ls->screen[4 * q + i][(*rows)[4 * q + i]] = drawn[i];
+    }
+  }
+#else
+  FOR_EACH_LANE(l, on) {
+    uint64_t bits = (uint64_t)(*sprite)[l] << (*x_cords)[l];
+    if (ls->screen[l][(*rows)[l]] & bits) {
+      hit |= 1U << l;
+    }
+    ls->screen[l][(*rows)[l]] ^= bits;
+  }
+#endif
+  return hit;
+}
+
+// Zero extends the 8 bit lanes to 16 bits
+void lane_widen(union lane_u16 *wide, lane_u8 *narrow) {
+#ifdef __AVX2__
+  wide->part[0] = (part_u16)_mm256_cvtepu8_epi16(
+      _mm256_castsi256_si128((__m256i)*narrow));
+  wide->part[1] = (part_u16)_mm256_cvtepu8_epi16(
+      _mm256_extracti128_si256((__m256i)*narrow, 1));
+#else
+  for (int l = 0; l < LOCKSTEP_LANES; l++) {
+    wide->lane[l] = (*narrow)[l];
+  }
+#endif
+}
+
+// Runs one instruction for every live lane that is at the same PC
+// with the same opcode as the lowest live PC. Lanes that branched
+// elsewhere sit out until the lowest PC catches up with them, which
+// is where they re-converge. Returns 0 once no lane is live
+int lockstep_step(struct lockstep_state *ls, uint32_t max_steps) {
+  // Dead lanes get PC 0xFFFF so they never have the lowest one
+  union lane_u16 pcs, at_pc;
+  for (int p = 0; p < LOCKSTEP_LANES / 16; p++) {
+    pcs.part[p] = ls->program_counter.part[p] | ls->dead.part[p];
+  }
+  uint16_t pc = lane_min(&pcs);
+  for (int p = 0; p < LOCKSTEP_LANES / 16; p++) {
+    at_pc.part[p] = (part_u16)(pcs.part[p] == pc) & ~ls->dead.part[p];
+  }
+  uint32_t mask = lane_bits16(&at_pc);
+  if (mask == 0) {
+    return 0;
+  }
+
+  uint8_t *leader_memory = ls->memory[__builtin_ctz(mask)];
+  uint16_t opcode = (((uint16_t)leader_memory[pc & 0x0FFFU]) << 8) |
+                    (uint16_t)leader_memory[(pc + 1) & 0x0FFFU];
+  if (ls->written[pc & 0x0FFFU] || ls->written[(pc + 1) & 0x0FFFU]) {
+    union lane_u16 opcodes, same;
+    lockstep_fetch(ls, &opcodes);
+    for (int p = 0; p < LOCKSTEP_LANES / 16; p++) {
+      same.part[p] = (part_u16)(opcodes.part[p] == opcode);
+    }
+    mask &= lane_bits16(&same);
+  }
+
+  lane_u8 m8;
+  union lane_u16 m16;
+  lane_mask8(&m8, mask);
+  lane_mask16(&m16, mask);
+
+  unsigned int x = (opcode & 0x0F00U) >> 8;
+  unsigned int y = (opcode & 0x00F0U) >> 4;
+  uint8_t kk = opcode & 0x00FFU;
+  uint16_t nnn = opcode & 0x0FFFU;
+  lane_u8 *v = ls->registers;
+  lane_u8 prev = v[x];
+  lane_u8 skip = {0};
+  int advance = 1;
+
+  // Each case mirrors the instr_* function it is named after,
+  // including the order registers are read and written in
+  switch (lockstep_decode[opcode]) {
+  case LS_ILLEGAL:
+    ls->illegal |= mask;
+    lockstep_stop(ls, mask);
+    return 1;
+  case LS_CLS:
+    FOR_EACH_LANE(l, mask) {
+      memset(ls->screen[l], 0, sizeof(ls->screen[l]));
+    }
+    break;
+  case LS_RET:
+    advance = 0;
+    FOR_EACH_LANE(l, mask) {
+      ls->stack_pointer[l]--;
+      ls->program_counter.lane[l] =
+          ls->stack[l][ls->stack_pointer[l] & 0xFU] + 2;
+    }
+    break;
+  case LS_JP:
+    advance = 0;
+    for (int p = 0; p < LOCKSTEP_LANES / 16; p++) {
+      ls->program_counter.part[p] = LANE_BLEND(
+          m16.part[p], (part_u16){0} + nnn, ls->program_counter.part[p]);
+    }
+    break;
+  case LS_CALL:
+    advance = 0;
+    FOR_EACH_LANE(l, mask) {
+      ls->stack[l][ls->stack_pointer[l] & 0xFU] = ls->program_counter.lane[l];
+      ls->stack_pointer[l]++;
+      ls->program_counter.lane[l] = nnn;
+    }
+    break;
+  case LS_SE:
+    skip = (lane_u8)(v[x] == kk);
+    break;
+  case LS_SNE:
+    skip = (lane_u8)(v[x] != kk);
+    break;
+  case LS_SE_REG:
+    skip = (lane_u8)(v[x] == v[y]);
+    break;
+  case LS_SNE_REG:
+    skip = (lane_u8)(v[x] != v[y]);
+    break;
+  case LS_LD:
+    v[x] = LANE_BLEND(m8, (lane_u8){0} + kk, v[x]);
+    break;
+  case LS_ADD:
+    v[x] = LANE_BLEND(m8, v[x] + kk, v[x]);
+    break;
+  case LS_LD_REG:
+    v[x] = LANE_BLEND(m8, v[y], v[x]);
+    break;
+  case LS_OR_REG:
+    v[x] = LANE_BLEND(m8, v[x] | v[y], v[x]);
+    v[0xF] &= ~m8;
+    break;
+  case LS_AND_REG:
+    v[x] = LANE_BLEND(m8, v[x] & v[y], v[x]);
+    v[0xF] &= ~m8;
+    break;
+  case LS_XOR_REG:
+    v[x] = LANE_BLEND(m8, v[x] ^ v[y], v[x]);
+    v[0xF] &= ~m8;
+    break;
+  case LS_ADD_REG:
+    v[x] = LANE_BLEND(m8, prev + v[y], v[x]);
+    v[0xF] = LANE_BLEND(m8, (lane_u8)(prev > v[x]) & 1, v[0xF]);
+    break;
+  case LS_SUB_REG:
+    v[x] = LANE_BLEND(m8, prev - v[y], v[x]);
+    v[0xF] = LANE_BLEND(m8, (lane_u8)(prev >= v[x]) & 1, v[0xF]);
+    break;
+  case LS_SHR_REG:
+    v[x] = LANE_BLEND(m8, v[y] >> 1, v[x]);
+    v[0xF] = LANE_BLEND(m8, prev & 1, v[0xF]);
+    break;
+  case LS_SHL_REG:
+    v[x] = LANE_BLEND(m8, v[y] << 1, v[x]);
+    v[0xF] = LANE_BLEND(m8, prev >> 7, v[0xF]);
+    break;
+  case LS_SUBN_REG: {
+    lane_u8 reg_y = v[y];
+    v[x] = LANE_BLEND(m8, reg_y - prev, v[x]);
+    v[0xF] = LANE_BLEND(m8, (lane_u8)(reg_y >= prev) & 1, v[0xF]);
+    break;
+  }
+  case LS_LD_I:
+    for (int p = 0; p < LOCKSTEP_LANES / 16; p++) {
+      ls->index.part[p] =
+          LANE_BLEND(m16.part[p], (part_u16){0} + nnn, ls->index.part[p]);
+    }
+    break;
+  case LS_ADD_I_REG: {
+    union lane_u16 reg_x;
+    lane_widen(&reg_x, &v[x]);
+    for (int p = 0; p < LOCKSTEP_LANES / 16; p++) {
+      ls->index.part[p] += m16.part[p] & reg_x.part[p];
+    }
+    break;
+  }
+  case LS_LD_REG_I:
+    for (unsigned int i = 0; i <= x; i++) {
+      lane_u8 bytes;
+      lockstep_gather(ls, &ls->index, i, &bytes);
+      v[i] = LANE_BLEND(m8, bytes, v[i]);
+    }
+    for (int p = 0; p < LOCKSTEP_LANES / 16; p++) {
+      ls->index.part[p] += m16.part[p] & 1;
+    }
+    break;
+  case LS_LD_I_REG:
+    FOR_EACH_LANE(l, mask) {
+      for (unsigned int i = 0; i <= x; i++) {
+        ls->memory[l][(ls->index.lane[l] + i) & 0x0FFFU] = v[i][l];
+        ls->written[(ls->index.lane[l] + i) & 0x0FFFU] = 1;
+      }
+      ls->index.lane[l]++;
+    }
+    break;
+  case LS_LD_B_REG:
+    FOR_EACH_LANE(l, mask) {
+      uint16_t index = ls->index.lane[l];
+      unsigned int val = v[x][l];
+      ls->memory[l][(index + 2) & 0x0FFFU] = val % 10;
+      val /= 10;
+      ls->memory[l][(index + 1) & 0x0FFFU] = val % 10;
+      val /= 10;
+      ls->memory[l][index & 0x0FFFU] = val % 10;
+      for (unsigned int i = 0; i < 3; i++) {
+        ls->written[(index + i) & 0x0FFFU] = 1;
+      }
+    }
+    break;
+  case LS_DRW: {
+    lane_u8 x_cords = v[x] % SCREEN_WIDTH;
+    lane_u8 y_cords = v[y] % SCREEN_HEIGHT;
+    uint8_t size = opcode & 0x000FU;
+    uint32_t hit = 0;
+    for (unsigned int r = 0; r < size; r++) {
+      // Rows past the bottom are clipped, and rows only go down
+      lane_u8 rows = y_cords + (uint8_t)r;
+      lane_u8 on = m8 & (lane_u8)(rows < SCREEN_HEIGHT);
+      uint32_t on_bits = lane_bits(&on);
+      if (on_bits == 0) {
+        break;
+      }
+      rows &= SCREEN_HEIGHT - 1;
+
+      // Sprite pixel c is bit 7 - c, on screen it's bit x + c. Bits
+      // shifted past 63 are clipped at the right edge
+      lane_u8 sprite;
+      lockstep_gather(ls, &ls->index, r, &sprite);
+      sprite = ((sprite & 0xF0) >> 4) | ((sprite & 0x0F) << 4);
+      sprite = ((sprite & 0xCC) >> 2) | ((sprite & 0x33) << 2);
+      sprite = ((sprite & 0xAA) >> 1) | ((sprite & 0x55) << 1);
+      hit |= lockstep_draw_row(ls, &rows, &sprite, &x_cords, on_bits);
+    }
+    lane_u8 hit8;
+    lane_mask8(&hit8, hit);
+    v[0xF] = LANE_BLEND(m8, hit8 & 1, v[0xF]);
+    break;
+  }
+  case LS_RND_REG: {
+    union lane_u32 m32;
+    lane_mask32(&m32, mask);
+    for (int p = 0; p < LOCKSTEP_LANES / 8; p++) {
+      part_u32 rng = ls->rng.part[p];
+      rng ^= rng << 13;
+      rng ^= rng >> 17;
+      rng ^= rng << 5;
+      ls->rng.part[p] = LANE_BLEND(m32.part[p], rng, ls->rng.part[p]);
+    }
+    FOR_EACH_LANE(l, mask) {
+      v[x][l] = ls->rng.lane[l] & kk;
+    }
+    break;
+  }
+  case LS_NOP:
+    break;
+  case LS_SKP_REG:
+  case LS_SKNP_REG: {
+    uint8_t wanted = lockstep_decode[opcode] == LS_SKP_REG;
+    FOR_EACH_LANE(l, mask) {
+      skip[l] = ls->keypad[l][v[x][l] & 0xFU] == wanted ? 0xFF : 0;
+    }
+    break;
+  }
+  case LS_LD_DT_REG:
+    ls->delay_timer = LANE_BLEND(m8, v[x], ls->delay_timer);
+    break;
+  case LS_LD_ST_REG:
+    ls->sound_timer = LANE_BLEND(m8, v[x], ls->sound_timer);
+    break;
+  case LS_LD_REG_DT:
+    v[x] = LANE_BLEND(m8, ls->delay_timer, v[x]);
+    break;
+  case LS_LD_F_REG:
+    v[x] = LANE_BLEND(m8, ls->delay_timer, v[x]);
+    FOR_EACH_LANE(l, mask) {
+      uint8_t digit = ls->delay_timer[l];
+      ls->index.lane[l] = digit < FONTSET_SIZE ? fontset[digit] : 0;
+    }
+    break;
+  case LS_LD_REG_K:
+    advance = 0;
+    FOR_EACH_LANE(l, mask) {
+      for (uint8_t k = 0; k < 16; k++) {
+        if (ls->keypad[l][k]) {
+          ls->delay_timer[l] = 0;
+          v[x][l] = k;
+          ls->program_counter.lane[l] += 2;
+          break;
+        }
+      }
+    }
+    break;
+  }
+
+  if (advance) {
+    union lane_u16 skip16;
+    lane_mask16(&skip16, lane_bits(&skip) & mask);
+    for (int p = 0; p < LOCKSTEP_LANES / 16; p++) {
+      ls->program_counter.part[p] += (m16.part[p] & 2) + (skip16.part[p] & 2);
+    }
+  }
+
+  // Lanes that finished their chunk are at a frame boundary (same as
+  // scripted_step) or done
+  ls->chunk_left -= m8 & 1;
+  lane_u8 ended = m8 & (lane_u8)(ls->chunk_left == 0);
+  FOR_EACH_LANE(l, lane_bits(&ended)) {
+    ls->steps[l] += ls->chunk[l];
+    ls->chunk[l] = 0;
+    if (ls->steps[l] == max_steps) {
+      lockstep_stop(ls, 1U << l);
+      continue;
+    }
+    if (ls->sound_timer[l] > 0) {
+      ls->sound_timer[l]--;
+    }
+    if (ls->delay_timer[l] > 0) {
+      ls->delay_timer[l]--;
+    }
+    script_keypad(ls->keypad[l], &ls->script[l],
+                  ls->steps[l] / LOCKSTEP_FRAME_INSTRS);
+    lockstep_start_chunk(ls, l, max_steps);
+  }
+
+  return 1;
+}
+
+// Compares one lane against a scalar run, printing what differs.
+// Returns the number of mismatches
+int lockstep_compare(struct lockstep_state *ls, int l,
+                     struct emu_state *expected, int expected_illegal) {
+  int mismatches = 0;
+
+  for (int r = 0; r < 16; r++) {
+    if (ls->registers[r][l] != expected->registers[r]) {
+      printf("Lane %d: V%X is %d, expected %d\n", l, r, ls->registers[r][l],
+             expected->registers[r]);
+      mismatches++;
+    }
+  }
+  if (ls->index.lane[l] != expected->index ||
+      ls->program_counter.lane[l] != expected->program_counter ||
+      ls->stack_pointer[l] != expected->stack_pointer ||
+      ls->delay_timer[l] != expected->delay_timer ||
+      ls->sound_timer[l] != expected->sound_timer ||
+      ls->rng.lane[l] != expected->rng) {
+    printf("Lane %d: I/PC/SP/DT/ST/RNG are %#x/%#x/%d/%d/%d/%#x, expected "
+           "%#x/%#x/%d/%d/%d/%#x\n",
+           l, ls->index.lane[l], ls->program_counter.lane[l],
+           ls->stack_pointer[l], ls->delay_timer[l], ls->sound_timer[l],
+           ls->rng.lane[l], expected->index,
+           expected->program_counter, expected->stack_pointer,
+           expected->delay_timer, expected->sound_timer, expected->rng);
+    mismatches++;
+  }
+  if (memcmp(ls->stack[l], expected->stack, sizeof(expected->stack)) != 0) {
+    printf("Lane %d: stack differs\n", l);
+    mismatches++;
+  }
+  if (memcmp(ls->memory[l], expected->memory, sizeof(expected->memory)) != 0) {
+    printf("Lane %d: memory differs\n", l);
+    mismatches++;
+  }
+  for (int r = 0; r < SCREEN_HEIGHT; r++) {
+    for (int c = 0; c < SCREEN_WIDTH; c++) {
+      uint32_t pixel = (ls->screen[l][r] >> c) & 1 ? 0xFFFFFFFF : 0;
+      if (pixel != expected->screen[r * SCREEN_WIDTH + c]) {
+        printf("Lane %d: screen differs at (%d, %d)\n", l, c, r);
+        mismatches++;
+        r = SCREEN_HEIGHT;
+        break;
+      }
+    }
+  }
+  if ((int)((ls->illegal >> l) & 1U) != expected_illegal) {
+    printf("Lane %d: illegal instruction %s\n", l,
+           expected_illegal ? "expected" : "not expected");
+    mismatches++;
+  }
+
+  return mismatches;
+}
+
+// Writes one line per lane with its seed, the instructions it ran,
+// whether it stopped on an illegal instruction, its registers and its
+// screen. "-" writes to stdout
+void write_lane_results(char *file_name, struct lockstep_state *ls,
+                        int lanes) {
+  FILE *file = strcmp(file_name, "-") == 0 ? stdout : fopen(file_name, "w");
+
+  if (file == NULL) {
+    printf("Error writing results file.\n");
+    return;
+  }
+
+  for (int l = 0; l < lanes; l++) {
+    fprintf(file,
+            "lane=%d seed=%#x steps=%u illegal=%u pc=%#x i=%#x sp=%d dt=%d "
+            "st=%d v=",
+            l, ls->script[l].seed, lockstep_lane_steps(ls, l),
+            (ls->illegal >> l) & 1U, ls->program_counter.lane[l],
+            ls->index.lane[l], ls->stack_pointer[l], ls->delay_timer[l],
+            ls->sound_timer[l]);
+    for (int r = 0; r < 16; r++) {
+      fprintf(file, "%02x", ls->registers[r][l]);
+    }
+    fprintf(file, " screen=");
+    for (int r = 0; r < SCREEN_HEIGHT; r++) {
+      fprintf(file, "%016llx", (unsigned long long)ls->screen[l][r]);
+    }
+    fprintf(file, "\n");
+  }
+
+  if (file != stdout) {
+    fclose(file);
+  }
+}
+
+// Headless entry point for lockstep mode. Runs lanes copies of the
+// ROM for max_steps instructions each and reports throughput. Lane
+// scripts come from script_file if set, otherwise from base_seed.
+// Results go to results_file if set. With verify every lane is also
+// run on the scalar interpreter and compared. Returns the process
+// exit code
+int run_lockstep(char *file_name, int lanes, uint32_t max_steps,
+                 uint32_t base_seed, char *script_file, char *results_file,
+                 int verify) {
+  static struct emu_state initial;
+  static struct lockstep_state ls;
+  static struct lane_script scripts[LOCKSTEP_LANES];
+
+  if (lanes < 1 || lanes > LOCKSTEP_LANES) {
+    printf("Lockstep supports 1 to %d lanes.\n", LOCKSTEP_LANES);
+    return 1;
+  }
+
+#ifndef __AVX2__
+  printf("Warning: built without AVX2, lockstep will likely be slower than "
+         "scalar. Use make build-lockstep.\n");
+#endif
+
+  if (script_file != NULL) {
+    if (!load_lane_scripts(script_file, scripts, lanes)) {
+      return 1;
+    }
+  } else {
+    for (int l = 0; l < lanes; l++) {
+      scripts[l].seed = lane_seed(base_seed, l);
+    }
+  }
+
+  memset(&initial, 0, sizeof(initial));
+  if (load_rom(file_name, &initial) == (uint16_t)-1) {
+    return 1;
+  }
+  initial.program_counter = BASE_ADDR;
+
+  lockstep_build_decode();
+  lockstep_init(&ls, &initial, lanes, scripts, max_steps);
+
+  double freq = (double)SDL_GetPerformanceFrequency();
+  uint64_t start = SDL_GetPerformanceCounter();
+  while (lockstep_step(&ls, max_steps)) {
+  }
+  double lockstep_secs = (SDL_GetPerformanceCounter() - start) / freq;
+
+  long total = 0;
+  for (int l = 0; l < lanes; l++) {
+    total += lockstep_lane_steps(&ls, l);
+  }
+  printf("Lockstep: %d lanes, %ld instructions in %.3fs (%.0f instructions/sec)\n",
+         lanes, total, lockstep_secs, total / lockstep_secs);
+
+  if (results_file != NULL) {
+    write_lane_results(results_file, &ls, lanes);
+  }
+
+  if (!verify) {
+    return 0;
+  }
+
+  int mismatches = 0;
+  double scalar_secs = 0;
+  for (int l = 0; l < lanes; l++) {
+    struct emu_state expected = initial;
+    int expected_illegal = 0;
+    expected.rng = scripts[l].seed;
+
+    start = SDL_GetPerformanceCounter();
+    for (uint32_t step = 0; step < max_steps; step++) {
+      if (!scripted_step(&expected, &scripts[l], step)) {
+        expected_illegal = 1;
+        break;
+      }
+    }
+    scalar_secs += (SDL_GetPerformanceCounter() - start) / freq;
+
+    mismatches += lockstep_compare(&ls, l, &expected, expected_illegal);
+  }
+
+  printf("Scalar: %.0f instructions/sec, lockstep is %.2fx the speed of scalar\n",
+         total / scalar_secs, scalar_secs / lockstep_secs);
+
+  if (mismatches > 0) {
+    printf("Lockstep verification FAILED with %d mismatches.\n", mismatches);
+    return 1;
+  }
+  printf("Lockstep verification passed for all %d lanes.\n", lanes);
+  return 0;
+}
 
 int main(int argc, char *argv[]) {
+  int turbo_mode = 0;
+  int show_overlay = 0;
+  char *stats_file = NULL;
+  int run_ahead_frames = 0;
+  int lockstep_lanes = 0;
+  uint32_t lockstep_steps = 100000;
+  uint32_t lockstep_seed = 1;
+  char *lockstep_script = NULL;
+  char *lockstep_results = NULL;
+  int lockstep_verify = 0;
+
+  for (int a = 2; a < argc; a++) {
+    if (strcmp(argv[a], "turbo") == 0) {
+      turbo_mode = 1;
+    } else if (strcmp(argv[a], "overlay") == 0) {
+      show_overlay = 1;
+    } else if (strncmp(argv[a], "stats=", 6) == 0) {
+      stats_file = argv[a] + 6;
+    } else if (strncmp(argv[a], "runahead=", 9) == 0) {
+      run_ahead_frames = atoi(argv[a] + 9);
+    } else if (strncmp(argv[a], "lockstep=", 9) == 0) {
+      lockstep_lanes = atoi(argv[a] + 9);
+    } else if (strncmp(argv[a], "steps=", 6) == 0) {
+      lockstep_steps = strtoul(argv[a] + 6, NULL, 0);
+    } else if (strncmp(argv[a], "seed=", 5) == 0) {
+      lockstep_seed = strtoul(argv[a] + 5, NULL, 0);
+    } else if (strncmp(argv[a], "script=", 7) == 0) {
+      lockstep_script = argv[a] + 7;
+    } else if (strncmp(argv[a], "results=", 8) == 0) {
+      lockstep_results = argv[a] + 8;
+    } else if (strcmp(argv[a], "verify") == 0) {
+      lockstep_verify = 1;
+    } else {
+      printf("Unknown option %s\n", argv[a]);
+      return 1;
+    }
+  }
+
+  if (lockstep_lanes > 0) {
+    return run_lockstep(argv[1], lockstep_lanes, lockstep_steps, lockstep_seed,
+                        lockstep_script, lockstep_results, lockstep_verify);
+  }
+
   struct emu_state state;
   uint16_t rom_size = load_rom(argv[1], &state);
+  if (rom_size == (uint16_t)-1) {
+    return 1;
+  }
   state.program_counter = BASE_ADDR;
   memset(state.screen, 0, sizeof(state.screen));
+  // Never 0, same as lane_seed, or xorshift gets stuck there
+  state.rng = (uint32_t)SDL_GetPerformanceCounter() | 1;
 
   SDL_Init(SDL_INIT_EVERYTHING);
   SDL_Window *window =
@@ -609,8 +1877,6 @@ int main(int argc, char *argv[]) {
                                            SDL_TEXTUREACCESS_STREAMING,
                                            SCREEN_WIDTH, SCREEN_HEIGHT);
 
-  int turbo_mode = argc == 3 && strcmp(argv[2], "turbo") == 0;
-
   if (turbo_mode) {
     printf("WARNING: Turbo mode has been enabled. Interpereter will run "
            "extremely fast!\n");
@@ -633,33 +1899,87 @@ int main(int argc, char *argv[]) {
 
   int pause = 0;
 
+  struct emu_stats stats;
+  struct emu_metrics metrics;
+  memset(&stats, 0, sizeof(stats));
+  memset(&metrics, 0, sizeof(metrics));
+  uint64_t window_start = SDL_GetPerformanceCounter();
+  uint64_t t0 = 0, t1 = 0;
+  // Input, emulation and rendering are only timed once per frame and
+  // the sample is scaled by how often that part ran since the last
+  // one, the other iterations just count
+  int sample_input = 0, sample_emulate = 0, sample_render = 0;
+  uint64_t input_runs = 0, emulate_runs = 0, render_runs = 0;
+
+  // With run-ahead the screen is only presented once per real frame
+  struct emu_state ahead;
+  int sleep_usec = turbo_mode ? 100 : 2000;
+  int instrs_per_frame = FRAME_USEC / sleep_usec;
+
+  if (run_ahead_frames > 0) {
+    printf("Run-ahead enabled: %d frames (starting at %d instructions per frame)\n",
+           run_ahead_frames, instrs_per_frame);
+  }
+
   struct timeval last, cur;
   gettimeofday(&cur, NULL);
+  last = cur;
   for (long i = 0; i != -1; i++) {
-    if (state.delay_timer > 0 || state.sound_timer > 0) {
-        gettimeofday(&cur, NULL);
-        long msec = (cur.tv_sec - last.tv_sec) * 1000000 + cur.tv_usec - last.tv_usec; 
-        if (msec > 16666) {
-            last = cur;
-            if (state.sound_timer > 0) {
-                uint8_t old = state.sound_timer;
-                state.sound_timer -= 1 * (msec/16666);
-                state.sound_timer = state.sound_timer > old ? 0 : state.sound_timer;
-            }
-            if (state.delay_timer > 0){
-                uint8_t old = state.delay_timer;
-                state.delay_timer -= 1 * (msec/16666); 
-                state.delay_timer = state.delay_timer > old ? 0 : state.delay_timer;
-            }
+    int frame_ticked = 0;
+    gettimeofday(&cur, NULL);
+    long msec = (cur.tv_sec - last.tv_sec) * 1000000 + cur.tv_usec - last.tv_usec; 
+    if (msec > FRAME_USEC) {
+        long ticks = msec / FRAME_USEC;
+        last = cur;
+        frame_ticked = 1;
+        // Whatever is left over past the last whole tick is lost
+        // when last is reset, that's the drift
+        stats.timer_drift_usec += msec % FRAME_USEC;
+        sample_input = sample_emulate = sample_render = 1;
+        if (state.sound_timer > 0) {
+            uint8_t old = state.sound_timer;
+            state.sound_timer -= 1 * ticks;
+            state.sound_timer = state.sound_timer > old ? 0 : state.sound_timer;
+        }
+        if (state.delay_timer > 0){
+            uint8_t old = state.delay_timer;
+            state.delay_timer -= 1 * ticks; 
+            state.delay_timer = state.delay_timer > old ? 0 : state.delay_timer;
         }
     }
 
     struct key_event kev;
-    get_key(&kev);
+    input_runs++;
+    if (sample_input) {
+      t0 = SDL_GetPerformanceCounter();
+      get_key(&kev);
+      stats.input_ticks += (SDL_GetPerformanceCounter() - t0) * input_runs;
+      input_runs = 0;
+      sample_input = 0;
+    } else {
+      get_key(&kev);
+    }
 
     if (kev.keycode == 254 && !kev.down) {
         pause = !pause;
     }
+
+    // Checked once per frame, before the pause so the stats file
+    // keeps updating while paused
+    if (frame_ticked) {
+      t0 = SDL_GetPerformanceCounter();
+      if (t0 - window_start >= SDL_GetPerformanceFrequency()) {
+        update_metrics(&metrics, &stats, t0 - window_start, instrs_per_frame);
+        metrics.paused = pause;
+        metrics.waiting_key = 0;
+        if (stats_file != NULL) {
+          write_stats_file(stats_file, &metrics);
+        }
+        memset(&stats, 0, sizeof(stats));
+        window_start = t0;
+      }
+    }
+
     if(pause) {
         i--;
         continue;
@@ -676,9 +1996,7 @@ int main(int argc, char *argv[]) {
     printf("\n");
 
 
-    state.opcode = (((uint16_t)state.memory[state.program_counter]) << 8) |
-                   (uint16_t)state.memory[state.program_counter + 1];
-    void (*op_func)(struct emu_state *) = get_op_func(state.opcode);
+    void (*op_func)(struct emu_state *) = fetch_op(&state);
 
     printf("\n[%d] | PC: %#x / OPCODE: %#x / SOUND TIMER: %d/ DELAY TIMER: %d\n", i, state.program_counter,
            state.opcode, state.sound_timer, state.delay_timer);
@@ -688,20 +2006,76 @@ int main(int argc, char *argv[]) {
       return 1;
     }
 
-    op_func(&state);
+    // Fx0A blocks the loop, so say so before the file goes quiet
+    if (op_func == &instr_LD_reg_K && stats_file != NULL) {
+      metrics.waiting_key = 1;
+      write_stats_file(stats_file, &metrics);
+    }
+
+    stats.instructions++;
+    // Fx0A blocks until a key is hit so it's always timed, on its own
+    if (op_func == &instr_LD_reg_K) {
+      t0 = SDL_GetPerformanceCounter();
+      op_func(&state);
+      stats.wait_key_ticks += SDL_GetPerformanceCounter() - t0;
+    } else if (sample_emulate) {
+      emulate_runs++;
+      t0 = SDL_GetPerformanceCounter();
+      op_func(&state);
+      stats.emulate_ticks += (SDL_GetPerformanceCounter() - t0) * emulate_runs;
+      emulate_runs = 0;
+      sample_emulate = 0;
+    } else {
+      op_func(&state);
+      emulate_runs++;
+    }
+
+    if (run_ahead_frames == 0 || frame_ticked) {
+      struct emu_state *shown = &state;
 
-    if (state.sound_timer > 0)
-        SDL_SetTextureColorMod(texture, 255, 0, 0);
-    else
-        SDL_SetTextureColorMod(texture, 255, 255, 255);
-    
-    SDL_UpdateTexture(texture, NULL, state.screen,
-                          sizeof(state.screen[0]) * SCREEN_WIDTH);
-    SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
+      render_runs++;
+      if (sample_render || run_ahead_frames > 0) {
+        t1 = SDL_GetPerformanceCounter();
+      }
+
+      if (run_ahead_frames > 0) {
+        // Use the rate measured last window, sleeps overshoot so the
+        // nominal one runs too far ahead. It's only a guess until the
+        // first window closes, and a window spent paused measures 0
+        int ahead_instrs = (int)(metrics.instrs_per_frame + 0.5);
+        if (ahead_instrs < 1) {
+          ahead_instrs = instrs_per_frame;
+        }
+        run_ahead(&ahead, &state, run_ahead_frames, ahead_instrs);
+        t0 = SDL_GetPerformanceCounter();
+        stats.run_ahead_ticks += t0 - t1;
+        stats.run_ahead_frames++;
+        t1 = t0;
+        shown = &ahead;
+      }
+
+      if (shown->sound_timer > 0)
+          SDL_SetTextureColorMod(texture, 255, 0, 0);
+      else
+          SDL_SetTextureColorMod(texture, 255, 255, 255);
+
+      SDL_UpdateTexture(texture, NULL, shown->screen,
+                            sizeof(shown->screen[0]) * SCREEN_WIDTH);
+      SDL_RenderClear(renderer);
+      SDL_RenderCopy(renderer, texture, NULL, NULL);
+      if (show_overlay) {
+        draw_overlay(renderer, &metrics);
+      }
+      SDL_RenderPresent(renderer);
+      stats.presents++;
+      if (sample_render) {
+        stats.render_ticks += (SDL_GetPerformanceCounter() - t1) * render_runs;
+        render_runs = 0;
+        sample_render = 0;
+      }
+    }
 
-    usleep(turbo_mode ? 100 : 2000);
+    usleep(sleep_usec);
 
     if (SDL_QuitRequested()) {
       printf("Received Quit from SDL. Goodbye!");